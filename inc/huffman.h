@@ -2,9 +2,14 @@
 #define HUFFMAN_H
 
 #include "bit_stream.h"
+#include <stddef.h>
 #include <stdio.h>
 
-struct BitStream huffman_encode(const char *const message);
+// Compresses the message_len characters of message into *bs. Returns
+// message_len on success, or the offset of the first character that can't be
+// encoded, in which case *bs is left untouched.
+size_t huffman_encode(const char *message, size_t message_len,
+                      struct BitStream *bs);
 void huffman_decode(struct BitStream *bs, FILE *writeback);
 
 
@@ -1,19 +1,26 @@
 #ifndef IMAGE_H
 #define IMAGE_H
 
+#include <stddef.h>
+
 struct PngImage;
-struct Pixel {
-  unsigned char red;
-  unsigned char green;
-  unsigned char blue;
-  unsigned char alpha;
-};
 struct PngImage *image_read(const char *file_path);
+struct PngImage *image_read_mem(const unsigned char *data, size_t len);
 void image_write(struct PngImage *img, const char *file_path);
+// Encodes img as a PNG and returns the buffer it was built in, storing its size
+// in *len. The caller releases it with free() (STBIW_FREE).
+unsigned char *image_write_mem(struct PngImage *img, size_t *len);
 void image_free(struct PngImage *img);
 int image_get_width(struct PngImage *img);
 int image_get_height(struct PngImage *img);
-struct Pixel image_get_pixel(struct PngImage *img, int x, int y);
-void image_set_pixel(struct PngImage *img, int x, int y, struct Pixel pix);
+// Number of samples per pixel: 1 (gray), 2 (gray + alpha), 3 (RGB) or 4
+// (RGBA), matching the source PNG except that a tRNS chunk adds an alpha
+// channel and palettes expand to RGB(A). Written back out the same way.
+int image_get_channels(struct PngImage *img);
+// 16 if the source PNG was 16-bit, otherwise 8.
+int image_get_bit_depth(struct PngImage *img);
+// Interleaved samples, row by row, width * height * channels of them. 16-bit
+// samples take two bytes each, most significant first.
+unsigned char *image_get_samples(struct PngImage *img);
 
 #endif // IMAGE_H
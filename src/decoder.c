@@ -12,17 +12,18 @@ int main(int argc, char **argv) {
   }
   const char *const input_path = argv[1];
   struct PngImage *img = image_read(input_path);
-  int img_w = image_get_width(img), img_h = image_get_height(img);
-  unsigned char *buf = malloc(img_w * img_h);
+  size_t sample_count = (size_t)image_get_width(img) * image_get_height(img) *
+                        image_get_channels(img);
+  size_t buf_len = sample_count / 4;
+  unsigned char *buf = malloc(buf_len);
 
-  for (int y = 0; y < img_h; y++) {
-    for (int x = 0; x < img_w; x++) {
-      int bit_idx = x + y * img_w;
-      struct Pixel pix = image_get_pixel(img, x, y);
-      char msg_c = ((pix.red & 0x03) << 6) | ((pix.green & 0x03) << 4) |
-                   ((pix.blue & 0x03) << 2) | (pix.alpha & 0x03);
-      buf[bit_idx] = msg_c;
-    }
+  // see encoder.c for the sample layout
+  size_t stride = image_get_bit_depth(img) / 8;
+  const unsigned char *samples = image_get_samples(img) + stride - 1;
+  for (size_t i = 0; i < buf_len; i++) {
+    const unsigned char *s = &samples[4 * stride * i];
+    buf[i] = ((s[0] & 0x03) << 6) | ((s[2 * stride] & 0x03) << 4) |
+             ((s[stride] & 0x03) << 2) | (s[3 * stride] & 0x03);
   }
 
   struct BitStream bs = {0};
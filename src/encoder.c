@@ -4,9 +4,8 @@
 #include "image.h"
 #include <stdio.h>
 #include <stdlib.h>
-#include <string.h>
 
-char *file_to_buf(const char *file_path) {
+char *file_to_buf(const char *file_path, size_t *buf_len) {
   FILE *file_handle = fopen(file_path, "r");
   if (file_handle == NULL) {
     fprintf(stderr, "Could not open message file.");
@@ -25,6 +24,7 @@ char *file_to_buf(const char *file_path) {
   }
   fclose(file_handle);
   buf[file_len] = '\0';
+  *buf_len = file_len;
   return buf;
 }
 
@@ -39,8 +39,15 @@ int main(int argc, char **argv) {
   const char *const png_input_path = argv[1], *const png_output_path = argv[2],
                     *const message_path = argv[3];
 
-  const char *const message = file_to_buf(message_path);
-  struct BitStream bs = huffman_encode(message);
+  size_t message_len;
+  const char *const message = file_to_buf(message_path, &message_len);
+  struct BitStream bs;
+  size_t encoded_len = huffman_encode(message, message_len, &bs);
+  if (encoded_len != message_len) {
+    fprintf(stderr, "ERROR: Cannot encode character 0x%X at offset %zu.\n",
+            (unsigned char)message[encoded_len], encoded_len);
+    exit(EXIT_FAILURE);
+  }
 
   uint32_t crc = crc32(bs.data, bs.data_len - 1);
   bs.data = realloc(bs.data, bs.data_len + sizeof(crc));
@@ -51,43 +58,34 @@ int main(int argc, char **argv) {
   bs.data_len += sizeof(crc);
 
   struct PngImage *img = image_read(png_input_path);
-  int img_width = image_get_width(img);
-  int img_height = image_get_height(img);
+  size_t sample_count = (size_t)image_get_width(img) * image_get_height(img) *
+                        image_get_channels(img);
+  // each byte of the message takes the two low bits of four samples
+  size_t capacity = sample_count / 4;
 
-  if ((size_t)(img_width * img_height) < bs.data_len) {
+  if (capacity < bs.data_len) {
     fprintf(stderr,
-            "ERROR: Message is too long to encode into provided PNG. Max: %d, "
-            "message: %lu (plus CRC32 is %lu).\n",
-            img_width * img_height, strlen(message), strlen(message) + bs.data_len);
+            "ERROR: Message is too long to encode into provided PNG. Max: %zu, "
+            "message: %zu (plus CRC32 is %zu).\n",
+            capacity, message_len, message_len + bs.data_len);
     exit(EXIT_FAILURE);
   }
 
-  struct Pixel pix;
-
-  for (int y = 0; y < img_height; y++) {
-    for (int x = 0; x < img_width; x++) {
-      size_t byte_idx = x + y * img_width;
-      if (byte_idx >= bs.data_len) {
-        goto image_loop_done;
-      }
-
-      pix = image_get_pixel(img, x, y);
-      unsigned char msg_c = bs.data[byte_idx];
-
-      pix.red &= 0xFC;
-      pix.green &= 0xFC;
-      pix.blue &= 0xFC;
-      pix.alpha &= 0xFC;
-
-      pix.red |= (msg_c & 0xC0) >> 6;
-      pix.green |= (msg_c & 0x30) >> 4;
-      pix.blue |= (msg_c & 0x0C) >> 2;
-      pix.alpha |= (msg_c & 0x03);
-
-      image_set_pixel(img, x, y, pix);
-    }
+  // samples run across pixels, so this works for any channel count. the middle
+  // two samples are swapped relative to bit order, which keeps RGBA images
+  // compatible with what older versions wrote pixel by pixel. 16-bit samples
+  // are big-endian, so their low bits live in the second byte
+  size_t stride = image_get_bit_depth(img) / 8;
+  unsigned char *samples = image_get_samples(img) + stride - 1;
+  for (size_t i = 0; i < bs.data_len; i++) {
+    unsigned char msg_c = bs.data[i];
+    unsigned char *s = &samples[4 * stride * i];
+    s[0] = (s[0] & 0xFC) | ((msg_c & 0xC0) >> 6);
+    s[stride] = (s[stride] & 0xFC) | ((msg_c & 0x0C) >> 2);
+    s[2 * stride] = (s[2 * stride] & 0xFC) | ((msg_c & 0x30) >> 4);
+    s[3 * stride] = (s[3 * stride] & 0xFC) | (msg_c & 0x03);
   }
-image_loop_done:
+
   image_write(img, png_output_path);
   image_free(img);
   free(bs.data);
@@ -1,5 +1,4 @@
 #include "bit_stream.h"
-#include <assert.h>
 #include <limits.h>
 #include <stdbool.h>
 #include <stdint.h>
@@ -13,21 +12,42 @@
 
 #define REDUCED_ASCII_LEN 99
 
+// marks bytes that fall outside the reduced ASCII alphabet
+#define REDUCED_ASCII_INVALID 0xFF
+
+// look-up table from a byte to its reduced ASCII symbol
+const unsigned char reduced_ascii_lut[256] = {
+    0x00, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x01, 0x02, 0xFF,
+    0xFF, 0x03, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0x04, 0x05, 0x06, 0x07,
+    0x08, 0x09, 0x0A, 0x0B, 0x0C, 0x0D, 0x0E, 0x0F, 0x10, 0x11, 0x12, 0x13,
+    0x14, 0x15, 0x16, 0x17, 0x18, 0x19, 0x1A, 0x1B, 0x1C, 0x1D, 0x1E, 0x1F,
+    0x20, 0x21, 0x22, 0x23, 0x24, 0x25, 0x26, 0x27, 0x28, 0x29, 0x2A, 0x2B,
+    0x2C, 0x2D, 0x2E, 0x2F, 0x30, 0x31, 0x32, 0x33, 0x34, 0x35, 0x36, 0x37,
+    0x38, 0x39, 0x3A, 0x3B, 0x3C, 0x3D, 0x3E, 0x3F, 0x40, 0x41, 0x42, 0x43,
+    0x44, 0x45, 0x46, 0x47, 0x48, 0x49, 0x4A, 0x4B, 0x4C, 0x4D, 0x4E, 0x4F,
+    0x50, 0x51, 0x52, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59, 0x5A, 0x5B,
+    0x5C, 0x5D, 0x5E, 0x5F, 0x60, 0x61, 0x62, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF,
+    0xFF, 0xFF, 0xFF, 0xFF,
+};
+
 unsigned char map_reduced_ascii(unsigned char original) {
-  if (original == '\0') {
-    return 0x00;
-  } else if (original == '\t') {
-    return 0x01;
-  } else if (original == '\n') {
-    return 0x02;
-  } else if (original == '\r') {
-    return 0x03;
-  } else if (0x20 <= original && original <= 0x7E) {
-    return original - 0x1C;
-  } else {
+  unsigned char mapped = reduced_ascii_lut[original];
+  if (mapped == REDUCED_ASCII_INVALID) {
     fprintf(stderr, "ERROR: Cannot map character 0x%X.\n", original);
     exit(EXIT_FAILURE);
   }
+  return mapped;
 }
 
 unsigned char unmap_reduced_ascii(unsigned char mapped) {
@@ -47,146 +67,151 @@ unsigned char unmap_reduced_ascii(unsigned char mapped) {
   }
 }
 
-// heap code is referenced from CLRS Ch. 6
-
-struct AsciiNode {
-  unsigned char symbol;
-  unsigned freq;
-  struct AsciiNode *left, *right;
-};
+// Longest code we can represent in a uint64_t. Reaching this depth requires
+// Fibonacci-distributed symbol frequencies summing to more than F(66) (~2.7e13)
+// characters, so the encoder never hits it in practice. The decoder still has
+// to check, since code lengths are read from untrusted input.
+#define MAX_CODE_LEN 64
 
-struct AsciiHeap {
-  struct AsciiNode *heap[REDUCED_ASCII_LEN];
-  size_t len;
+struct HuffmanTable {
+  unsigned char code_len[REDUCED_ASCII_LEN];
+  uint64_t code[REDUCED_ASCII_LEN];
+  // number of codes of each length, used by the canonical decoder
+  unsigned char len_count[MAX_CODE_LEN + 1];
+  // symbols in canonical order (by code length, then by symbol)
+  unsigned char sorted_symbols[REDUCED_ASCII_LEN];
 };
 
-bool is_node_leaf(const struct AsciiNode *const node) {
-  return (node->right == NULL) && (node->left == NULL);
-}
-
-// i is one-based (e.g. if min-heapifying from the root, pass 1)
-void min_heapify(struct AsciiHeap *ascii_heap, size_t i) {
-  struct AsciiNode **heap = ascii_heap->heap;
-  size_t len = ascii_heap->len;
-  size_t l = 2 * i, r = 2 * i + 1, smallest = i;
-  if (l <= len && heap[l - 1]->freq < heap[i - 1]->freq) {
-    smallest = l;
+// Computes Huffman code lengths from symbol frequencies without building a
+// pointer tree. Present symbols are sorted by frequency, then merged with the
+// two-queue method: internal nodes are created in nondecreasing weight order,
+// so the cheapest remaining node is always at the head of one of two queues.
+void compute_code_lengths(struct HuffmanTable *tab,
+                          const uint64_t freq[REDUCED_ASCII_LEN]) {
+  // sort keys pack the frequency above the symbol. leaves are collected in
+  // symbol order and sorted with a stable LSD radix sort on the frequency
+  // bytes, so ties stay broken by symbol. short messages need a single pass.
+  // absent symbols are skipped without a branch, since whether a given symbol
+  // shows up in a short message is close to random
+  uint64_t leaves[REDUCED_ASCII_LEN], scratch[REDUCED_ASCII_LEN];
+  uint64_t key_bits = 0;
+  size_t n = 0;
+  for (unsigned char s = 0; s < REDUCED_ASCII_LEN; s++) {
+    leaves[n] = (freq[s] << 7) | s;
+    key_bits |= leaves[n];
+    n += freq[s] != 0;
   }
-  if (r <= len && heap[r - 1]->freq < heap[smallest - 1]->freq) {
-    smallest = r;
+  uint64_t *src = leaves, *dst = scratch;
+  for (unsigned shift = 7; shift < 64 && (key_bits >> shift) != 0; shift += 8) {
+    // only touch as many buckets as the largest digit can reach
+    size_t buckets = (key_bits >> shift) > 0xFF ? 256 : (key_bits >> shift) + 1;
+    unsigned char bucket_start[256];
+    memset(bucket_start, 0, buckets);
+    for (size_t i = 0; i < n; i++) {
+      bucket_start[(src[i] >> shift) & 0xFF] += 1;
+    }
+    unsigned char offset = 0;
+    for (size_t b = 0; b < buckets; b++) {
+      unsigned char count = bucket_start[b];
+      bucket_start[b] = offset;
+      offset += count;
+    }
+    for (size_t i = 0; i < n; i++) {
+      dst[bucket_start[(src[i] >> shift) & 0xFF]++] = src[i];
+    }
+    uint64_t *hold = src;
+    src = dst;
+    dst = hold;
   }
-  if (smallest != i) {
-    struct AsciiNode *hold = heap[i - 1];
-    heap[i - 1] = heap[smallest - 1];
-    heap[smallest - 1] = hold;
-    min_heapify(ascii_heap, smallest);
+  if (src != leaves) {
+    memcpy(leaves, src, n * sizeof(leaves[0]));
   }
-}
 
-void build_min_heap(struct AsciiHeap *ascii_heap) {
-  for (size_t i = ascii_heap->len / 2; i > 0; i--) {
-    min_heapify(ascii_heap, i);
+  memset(tab->code_len, 0, sizeof(tab->code_len));
+  if (n == 0) {
+    return;
   }
-}
-
-// fails assertion on heap underflow, check before calling
-struct AsciiNode *extract_min(struct AsciiHeap *ascii_heap) {
-  assert(ascii_heap->len != 0);
-
-  struct AsciiNode *min = ascii_heap->heap[0];
-  ascii_heap->heap[0] = ascii_heap->heap[ascii_heap->len - 1];
-  ascii_heap->len -= 1;
-  min_heapify(ascii_heap, 1);
-  return min;
-}
-
-struct SymbolAndCode {
-  unsigned char symbol;
-  bool code[REDUCED_ASCII_LEN - 1];
-  size_t code_len;
-};
-
-struct HuffmanTable {
-  struct SymbolAndCode table[REDUCED_ASCII_LEN];
-};
-
-void tabulate_huffman_tree(struct HuffmanTable *table,
-                           const struct AsciiNode *const root, int code_len) {
-  if (is_node_leaf(root)) {
-    struct SymbolAndCode *s = &table->table[root->symbol];
-    s->symbol = root->symbol;
-    memset(s->code, false, sizeof(s->code));
-    s->code_len = code_len;
-  } else {
-    tabulate_huffman_tree(table, root->left, code_len + 1);
-    tabulate_huffman_tree(table, root->right, code_len + 1);
+  if (n == 1) {
+    // a lone symbol still needs a one-bit code to be written to the stream
+    tab->code_len[leaves[0] & 0x7F] = 1;
+    return;
   }
-}
 
-void free_huffman_tree(struct AsciiNode *root) {
-  if (!is_node_leaf(root)) {
-    free_huffman_tree(root->left);
-    free_huffman_tree(root->right);
+  // node i < n is leaves[i], node n + k is the k-th internal node
+  uint64_t internal_weight[REDUCED_ASCII_LEN - 1];
+  unsigned char parent[2 * REDUCED_ASCII_LEN - 1];
+  size_t leaf_head = 0, internal_head = 0;
+  for (size_t k = 0; k < n - 1; k++) {
+    uint64_t weight = 0;
+    for (int child = 0; child < 2; child++) {
+      size_t node;
+      if (leaf_head < n &&
+          (internal_head == k ||
+           (leaves[leaf_head] >> 7) <= internal_weight[internal_head])) {
+        node = leaf_head++;
+        weight += leaves[node] >> 7;
+      } else {
+        node = n + internal_head++;
+        weight += internal_weight[node - n];
+      }
+      parent[node] = n + k;
+    }
+    internal_weight[k] = weight;
   }
-  free(root);
-}
 
-int canonical_comparator(const void *a_p, const void *b_p) {
-  const struct SymbolAndCode *a = a_p, *b = b_p;
-  if (a->code_len == 0) {
-    return 1;
-  } else if (b->code_len == 0) {
-    return -1;
+  // children always have lower node numbers than their parent, so walking
+  // down from the root (node 2n - 2) sees every parent before its children
+  unsigned char depth[2 * REDUCED_ASCII_LEN - 1];
+  depth[2 * n - 2] = 0;
+  for (size_t i = 2 * n - 2; i-- > 0;) {
+    depth[i] = depth[parent[i]] + 1;
   }
-
-  if (a->code_len != b->code_len) {
-    return a->code_len - b->code_len;
-  } else {
-    return (int)a->symbol - (int)b->symbol;
+  for (size_t i = 0; i < n; i++) {
+    if (depth[i] > MAX_CODE_LEN) {
+      fprintf(stderr, "ERROR: Huffman code length %u exceeds maximum of %d.\n",
+              depth[i], MAX_CODE_LEN);
+      exit(EXIT_FAILURE);
+    }
+    tab->code_len[leaves[i] & 0x7F] = depth[i];
   }
 }
 
-void bit_arr_shl(bool *arr, size_t len) {
-  assert(len > 0);
-  bool carry = false;
-  for (size_t i = 0; i < len; i++) {
-    bool hold = arr[i];
-    arr[i] = carry;
-    carry = hold;
+// Assigns canonical codes from tab->code_len (see RFC 1951 section 3.2.2).
+// Shared by the encoder and decoder; lengths must be <= MAX_CODE_LEN. Codes of
+// unused symbols are left unset.
+void generate_canonical_codes(struct HuffmanTable *tab) {
+  // gather used symbols first, without a branch, so the loops below only run
+  // over them
+  unsigned char used[REDUCED_ASCII_LEN];
+  size_t n_used = 0;
+  for (unsigned char s = 0; s < REDUCED_ASCII_LEN; s++) {
+    used[n_used] = s;
+    n_used += tab->code_len[s] != 0;
   }
-}
 
-void bit_arr_inc(bool *arr, size_t len) {
-  for (size_t i = 0; i < len; i++) {
-    if (arr[i]) {
-      arr[i] = false;
-    } else {
-      arr[i] = true;
-      break;
-    }
+  unsigned char max_len = 0;
+  memset(tab->len_count, 0, sizeof(tab->len_count));
+  for (size_t i = 0; i < n_used; i++) {
+    unsigned char len = tab->code_len[used[i]];
+    tab->len_count[len] += 1;
+    max_len = len > max_len ? len : max_len;
   }
-}
 
-void generate_canonical_codes(struct HuffmanTable *table) {
-  qsort(table->table, REDUCED_ASCII_LEN, sizeof(struct SymbolAndCode),
-        &canonical_comparator);
-  bool bit_arr[REDUCED_ASCII_LEN - 1];
-  for (size_t i = 0; i < REDUCED_ASCII_LEN - 1; i++) {
-    bit_arr[i] = false;
-    table->table[0].code[i] = false;
+  uint64_t next_code[MAX_CODE_LEN + 1];
+  unsigned char next_offset[MAX_CODE_LEN + 1];
+  uint64_t code = 0;
+  unsigned char offset = 0;
+  for (size_t len = 1; len <= max_len; len++) {
+    code = (code + tab->len_count[len - 1]) << 1;
+    next_code[len] = code;
+    next_offset[len] = offset;
+    offset += tab->len_count[len];
   }
-  size_t bit_arr_len = table->table[0].code_len;
-  for (size_t i = 1; i < REDUCED_ASCII_LEN; i++) {
-    struct SymbolAndCode *snc = &table->table[i];
-    if (snc->code_len == 0) {
-      break;
-    }
-    bit_arr_inc(bit_arr, REDUCED_ASCII_LEN - 1);
-    while (bit_arr_len < snc->code_len) {
-      bit_arr_shl(bit_arr, REDUCED_ASCII_LEN - 1);
-      bit_arr_len += 1;
-    }
-    memcpy(snc->code, bit_arr, sizeof(bit_arr));
+
+  for (size_t i = 0; i < n_used; i++) {
+    unsigned char s = used[i], len = tab->code_len[s];
+    tab->code[s] = next_code[len]++;
+    tab->sorted_symbols[next_offset[len]++] = s;
   }
 }
 
@@ -206,162 +231,183 @@ unsigned char bs_extract_code_len(struct BitStream *bs) {
   return len;
 }
 
-void bs_insert_code(struct BitStream *bs, struct SymbolAndCode *snc) {
-  size_t code_len = snc->code_len;
+void bs_insert_code(struct BitStream *bs, uint64_t code, size_t code_len) {
   while (code_len > 0) {
-    bs_write_bit(bs, snc->code[code_len - 1]);
     code_len--;
+    bs_write_bit(bs, (code >> code_len) & 1);
   }
 }
 
-struct BitStream encode_message(struct HuffmanTable *table,
-                                const char *message) {
-  struct SymbolAndCode *lut[REDUCED_ASCII_LEN] = {0};
-  for (size_t i = 0; i < REDUCED_ASCII_LEN; i++) {
-    struct SymbolAndCode *snc = &table->table[i];
-    if (snc->code_len == 0) {
-      break;
-    }
-    lut[snc->symbol] = snc;
-  }
-
+struct BitStream encode_message(struct HuffmanTable *table, const char *message,
+                                size_t message_len) {
   struct BitStream bs = {
       /*
-       * TODO I'm /pretty/ sure we can just do strlen(msg) + RED_ASCII_LEN, but
+       * TODO I'm /pretty/ sure we can just do msg_len + RED_ASCII_LEN, but
        * I'm not entirely convinced and don't want to take the time to prove
        * it. we'll just double the length of the message here to be safe.
        */
-      .data = calloc(strlen(message) * 2 + REDUCED_ASCII_LEN, 1),
+      .data = calloc(message_len * 2 + REDUCED_ASCII_LEN, 1),
       .byte_offset = 0,
       .bit_offset = 0,
   };
 
   for (int i = 0; i < REDUCED_ASCII_LEN; i++) {
-    if (lut[i] != NULL) {
-      bs_insert_code_len(&bs, lut[i]->code_len);
-    } else {
-      bs_insert_code_len(&bs, 0);
-    }
+    bs_insert_code_len(&bs, table->code_len[i]);
   }
 
-  for (size_t i = 0; message[i] != '\0'; i++) {
-    struct SymbolAndCode *this_c = lut[map_reduced_ascii(message[i])];
-    bs_insert_code(&bs, this_c);
+  // message was validated by count_symbols, so every byte maps to a symbol
+  for (size_t i = 0; i < message_len; i++) {
+    unsigned char c = reduced_ascii_lut[(unsigned char)message[i]];
+    bs_insert_code(&bs, table->code[c], table->code_len[c]);
   }
-  bs_insert_code(&bs, lut[map_reduced_ascii('\0')]);
+  unsigned char eom = map_reduced_ascii('\0');
+  bs_insert_code(&bs, table->code[eom], table->code_len[eom]);
   bs.data_len = bs.byte_offset + !!bs.bit_offset + 1;
   bs.data = realloc(bs.data, bs.data_len);
   return bs;
 }
 
-struct BitStream huffman_encode(const char *const message) {
-  struct AsciiHeap ascii_heap = {.len = REDUCED_ASCII_LEN};
-  for (unsigned char c = 0; c < REDUCED_ASCII_LEN; c++) {
-    struct AsciiNode *node = malloc(sizeof(struct AsciiNode));
+#define SHORT_MESSAGE_LEN 512
+
+// Fills freq with the number of times each symbol appears in message. Returns
+// message_len if every byte is in the reduced ASCII alphabet, otherwise the
+// offset of the first byte that isn't. '\0' is reserved to mark the end of the
+// message, so it counts as invalid here.
+size_t count_symbols(const unsigned char *message, size_t message_len,
+                     uint64_t freq[REDUCED_ASCII_LEN]) {
+  memset(freq, 0, REDUCED_ASCII_LEN * sizeof(freq[0]));
+
+  // clearing and merging the interleaved tables below costs a few hundred ns
+  // per call, which only pays for itself past about this many bytes
+  if (message_len < SHORT_MESSAGE_LEN) {
+    for (size_t i = 0; i < message_len; i++) {
+      unsigned char mapped = reduced_ascii_lut[message[i]];
+      if (mapped == reduced_ascii_lut['\0'] ||
+          mapped == REDUCED_ASCII_INVALID) {
+        return i;
+      }
+      freq[mapped] += 1;
+    }
+    return message_len;
+  }
 
-    node->symbol = c;
-    node->freq = 0;
-    node->left = node->right = NULL;
+  uint64_t invalid = 0;
+
+  // count raw bytes into four interleaved tables, so runs of one character
+  // don't serialize on the store-to-load latency of a single counter. bytes
+  // are only mapped to symbols once per block, when the tables are merged.
+  // 32-bit counters keep the tables in L1, so blocks can't exceed UINT32_MAX
+  uint32_t byte_count[4][256];
+  for (size_t done = 0; done < message_len;) {
+    size_t block_len = message_len - done;
+    if (block_len > UINT32_MAX) {
+      block_len = UINT32_MAX;
+    }
+    const unsigned char *block = message + done;
+
+    memset(byte_count, 0, sizeof(byte_count));
+    size_t i = 0;
+    for (; i + 4 <= block_len; i += 4) {
+      byte_count[0][block[i + 0]] += 1;
+      byte_count[1][block[i + 1]] += 1;
+      byte_count[2][block[i + 2]] += 1;
+      byte_count[3][block[i + 3]] += 1;
+    }
+    for (; i < block_len; i++) {
+      byte_count[0][block[i]] += 1;
+    }
 
-    ascii_heap.heap[c] = node;
+    // merge the counts of every byte in the alphabet. anything else in the
+    // block, '\0' included, is invalid, which the leftover count catches
+    uint64_t valid = 0;
+    for (size_t b = 1; b < 256; b++) {
+      unsigned char mapped = reduced_ascii_lut[b];
+      if (mapped == REDUCED_ASCII_INVALID) {
+        continue;
+      }
+      uint64_t count = (uint64_t)byte_count[0][b] + byte_count[1][b] +
+                       byte_count[2][b] + byte_count[3][b];
+      freq[mapped] += count;
+      valid += count;
+    }
+    invalid += block_len - valid;
+    done += block_len;
   }
 
-  // count the frequency of each char in message
-  for (const char *c_p = message; *c_p != '\0'; c_p++) {
-    unsigned char c = map_reduced_ascii(*c_p);
-    ascii_heap.heap[c]->freq += 1;
+  if (invalid == 0) {
+    return message_len;
   }
-
-  // we'll use one '\0' later to indicate end of message
-  ascii_heap.heap[map_reduced_ascii('\0')]->freq = 1;
-
-  build_min_heap(&ascii_heap);
-
-  // remove symbos from the heap that weren't present in the message
-  while (ascii_heap.len > 0 && ascii_heap.heap[0]->freq == 0) {
-    free(extract_min(&ascii_heap));
+  // only on failure do we go back and find where the bad byte was
+  for (size_t i = 0; i < message_len; i++) {
+    if (message[i] == '\0' ||
+        reduced_ascii_lut[message[i]] == REDUCED_ASCII_INVALID) {
+      return i;
+    }
   }
+  return message_len;
+}
 
-  while (ascii_heap.len > 1) {
-    struct AsciiNode *min = extract_min(&ascii_heap);
-    struct AsciiNode *next_min = ascii_heap.heap[0];
-    struct AsciiNode *fork = malloc(sizeof(struct AsciiNode));
-    fork->freq = min->freq + next_min->freq;
-    fork->left = min;
-    fork->right = next_min;
-    ascii_heap.heap[0] = fork;
-    min_heapify(&ascii_heap, 1);
+size_t huffman_encode(const char *message, size_t message_len,
+                      struct BitStream *bs) {
+  uint64_t freq[REDUCED_ASCII_LEN];
+  size_t valid_len =
+      count_symbols((const unsigned char *)message, message_len, freq);
+  if (valid_len != message_len) {
+    return valid_len;
   }
 
-  struct HuffmanTable tab = {0};
-  tabulate_huffman_tree(&tab, ascii_heap.heap[0], 0);
-  free_huffman_tree(ascii_heap.heap[0]);
+  // we'll use one '\0' later to indicate end of message
+  freq[map_reduced_ascii('\0')] = 1;
+
+  struct HuffmanTable tab;
+  compute_code_lengths(&tab, freq);
   generate_canonical_codes(&tab);
 
-  return encode_message(&tab, message);
+  *bs = encode_message(&tab, message, message_len);
+  return message_len;
 }
 
-struct AsciiNode *detabulate_huffman_tree(struct HuffmanTable *tab) {
-  struct AsciiNode *root = calloc(1, sizeof(struct AsciiNode));
-  for (unsigned char i = 0; i < REDUCED_ASCII_LEN; i++) {
-    struct SymbolAndCode *snc = &tab->table[i];
-    if (snc->code_len == 0) {
-      continue;
+// decodes one symbol by walking the canonical code one length at a time; codes
+// of each length are consecutive integers, so no tree is needed
+unsigned char decode_symbol(struct HuffmanTable *tab, struct BitStream *bs) {
+  uint64_t code = 0, first = 0;
+  size_t index = 0;
+  for (size_t len = 1; len <= MAX_CODE_LEN; len++) {
+    code |= bs_read_bit(bs);
+    uint64_t count = tab->len_count[len];
+    if (code - first < count) {
+      return tab->sorted_symbols[index + (code - first)];
     }
-    struct AsciiNode *descend = root;
-    for (int bit = snc->code_len - 1; bit >= 0; bit--) {
-      if (snc->code[bit]) {
-        if (descend->right == NULL) {
-          descend->right = calloc(1, sizeof(struct AsciiNode));
-        }
-        descend = descend->right;
-      } else {
-        if (descend->left == NULL) {
-          descend->left = calloc(1, sizeof(struct AsciiNode));
-        }
-        descend = descend->left;
-      }
-    }
-    descend->symbol = snc->symbol;
-    descend->left = NULL;
-    descend->right = NULL;
+    index += count;
+    first = (first + count) << 1;
+    code <<= 1;
   }
-  return root;
+  fprintf(stderr, "ERROR: Invalid Huffman code in message.\n");
+  exit(EXIT_FAILURE);
 }
 
 void huffman_decode(struct BitStream *bs, FILE *writeback) {
-  struct HuffmanTable tab = {0};
+  struct HuffmanTable tab;
   bs->byte_offset = bs->bit_offset = 0;
   for (unsigned char i = 0; i < REDUCED_ASCII_LEN; i++) {
-    tab.table[i].symbol = i;
-    tab.table[i].code_len = bs_extract_code_len(bs);
+    tab.code_len[i] = bs_extract_code_len(bs);
+    if (tab.code_len[i] > MAX_CODE_LEN) {
+      fprintf(stderr, "ERROR: Huffman code length %u exceeds maximum of %d.\n",
+              tab.code_len[i], MAX_CODE_LEN);
+      exit(EXIT_FAILURE);
+    }
   }
 
   generate_canonical_codes(&tab);
 
-  struct AsciiNode *root = detabulate_huffman_tree(&tab);
-
-  unsigned char last_decoded = 1;
-  struct AsciiNode *descend = root;
   // all valid messages end with a '\0', which we break on in the loop
   while (true) {
-    bool l = bs_read_bit(bs);
-    if (l) {
-      descend = descend->right;
-    } else {
-      descend = descend->left;
-    }
-    if (is_node_leaf(descend)) {
-      last_decoded = unmap_reduced_ascii(descend->symbol);
-      if (last_decoded == '\0') {
-        break;
-      }
-      fprintf(writeback, "%c", last_decoded);
-      descend = root;
+    unsigned char last_decoded = unmap_reduced_ascii(decode_symbol(&tab, bs));
+    if (last_decoded == '\0') {
+      break;
     }
+    fprintf(writeback, "%c", last_decoded);
   }
 
   bs->data_len = bs->byte_offset + !!bs->bit_offset + 1;
-
-  free_huffman_tree(root);
 }
@@ -1,9 +1,18 @@
+#define _POSIX_C_SOURCE 200809L
 #include <limits.h>
 #if CHAR_BIT != 8
 #error Machine must have 8-bit bytes.
 #endif
+#include <errno.h>
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #define WUFFS_IMPLEMENTATION
 #define WUFFS_CONFIG__STATIC_FUNCTIONS
@@ -25,17 +34,291 @@
 struct PngImage {
   int width;
   int height;
-  unsigned char *pixels_rgba;
+  int channels;
+  int bit_depth;
+  unsigned char *samples;
 };
 
-struct PngImage *image_read(const char *file_path) {
+uint32_t png_read_u32(const unsigned char *p) {
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) |
+         ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+// Works out how many channels the PNG stores per pixel from its IHDR color
+// type, counting a tRNS chunk as an alpha channel since STBI expands it into
+// one. Palettes are expanded to RGB(A), as changing the low bits of an index
+// would pick a different color. Returns 4 if the header can't be parsed and
+// leaves the real error to STBI.
+int png_channels(const unsigned char *data, size_t len) {
+  const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                      '\r', '\n', 0x1A, '\n'};
+  if (len < 33 || memcmp(data, signature, 8) != 0 ||
+      memcmp(data + 12, "IHDR", 4) != 0) {
+    return 4;
+  }
+  unsigned char color_type = data[25];
+
+  bool has_trns = false;
+  for (size_t chunk = 8; chunk + 8 <= len;) {
+    uint32_t chunk_len = png_read_u32(data + chunk);
+    const unsigned char *chunk_type = data + chunk + 4;
+    if (memcmp(chunk_type, "IDAT", 4) == 0) {
+      break; // tRNS must come before the image data
+    }
+    if (memcmp(chunk_type, "tRNS", 4) == 0) {
+      has_trns = true;
+      break;
+    }
+    if (chunk_len > len - chunk - 8) {
+      break;
+    }
+    chunk += 12 + (size_t)chunk_len;
+  }
+
+  switch (color_type) {
+  case 0: // grayscale
+    return has_trns ? 2 : 1;
+  case 2: // RGB
+  case 3: // palette
+    return has_trns ? 4 : 3;
+  case 4: // grayscale + alpha
+    return 2;
+  default: // RGBA
+    return 4;
+  }
+}
+
+// STBI's memory loader takes an int length, anything larger is fed to it
+// through these callbacks instead
+struct MemReader {
+  const unsigned char *data;
+  size_t len;
+  size_t pos;
+};
+
+int mem_read(void *user, char *buf, int size) {
+  struct MemReader *r = user;
+  size_t n = r->len - r->pos < (size_t)size ? r->len - r->pos : (size_t)size;
+  memcpy(buf, r->data + r->pos, n);
+  r->pos += n;
+  return (int)n;
+}
+
+void mem_skip(void *user, int n) {
+  struct MemReader *r = user;
+  if (n < 0) {
+    r->pos = (size_t)-n > r->pos ? 0 : r->pos - (size_t)-n;
+  } else {
+    r->pos = (size_t)n > r->len - r->pos ? r->len : r->pos + (size_t)n;
+  }
+}
+
+int mem_eof(void *user) {
+  struct MemReader *r = user;
+  return r->pos == r->len;
+}
+
+// 16 for 16-bit PNGs, 8 for everything else (lower depths get widened to 8)
+int png_bit_depth(const unsigned char *data, size_t len) {
+  if (len < 33 || memcmp(data + 12, "IHDR", 4) != 0) {
+    return 8;
+  }
+  return data[24] == 16 ? 16 : 8;
+}
+
+// Decodes a 16-bit PNG with Wuffs' own API, since its STBI layer only hands out
+// 8-bit samples. Leaves BGRA pixels of 16-bit little-endian samples in
+// img->samples and returns NULL, or returns why it couldn't.
+const char *png_decode_bgra16(const unsigned char *data, size_t len,
+                              struct PngImage *img) {
+  wuffs_png__decoder *dec = wuffs_png__decoder__alloc();
+  if (dec == NULL) {
+    return "out of memory";
+  }
+  wuffs_base__io_buffer src =
+      wuffs_base__ptr_u8__reader((uint8_t *)data, len, true);
+  wuffs_base__image_config ic;
+  wuffs_base__status status =
+      wuffs_png__decoder__decode_image_config(dec, &ic, &src);
+  if (!wuffs_base__status__is_ok(&status)) {
+    free(dec);
+    return wuffs_base__status__message(&status);
+  }
+  uint32_t width = wuffs_base__pixel_config__width(&ic.pixcfg);
+  uint32_t height = wuffs_base__pixel_config__height(&ic.pixcfg);
+  uint64_t workbuf_len = wuffs_png__decoder__workbuf_len(dec).max_incl;
+  if (width > INT_MAX || height > INT_MAX ||
+      (height != 0 && width > SIZE_MAX / 8 / height) ||
+      workbuf_len > SIZE_MAX) {
+    free(dec);
+    return "image is too large";
+  }
+  wuffs_base__pixel_config__set(&ic.pixcfg,
+                                WUFFS_BASE__PIXEL_FORMAT__BGRA_NONPREMUL_4X16LE,
+                                WUFFS_BASE__PIXEL_SUBSAMPLING__NONE, width,
+                                height);
+
+  size_t pixels_len = (size_t)width * height * 8;
+  unsigned char *pixels = malloc(pixels_len);
+  unsigned char *workbuf = malloc(workbuf_len);
+  if ((pixels == NULL && pixels_len != 0) ||
+      (workbuf == NULL && workbuf_len != 0)) {
+    free(dec);
+    free(pixels);
+    free(workbuf);
+    return "out of memory";
+  }
+  wuffs_base__pixel_buffer pb;
+  status = wuffs_base__pixel_buffer__set_from_slice(
+      &pb, &ic.pixcfg, wuffs_base__make_slice_u8(pixels, pixels_len));
+  if (wuffs_base__status__is_ok(&status)) {
+    status = wuffs_png__decoder__decode_frame(
+        dec, &pb, &src, WUFFS_BASE__PIXEL_BLEND__SRC,
+        wuffs_base__make_slice_u8(workbuf, workbuf_len), NULL);
+  }
+  free(dec);
+  free(workbuf);
+  if (!wuffs_base__status__is_ok(&status)) {
+    free(pixels);
+    return wuffs_base__status__message(&status);
+  }
+  img->width = width;
+  img->height = height;
+  img->samples = pixels;
+  return NULL;
+}
+
+// squeezes BGRA 16-bit little-endian pixels down, in place, to the image's own
+// channels as big-endian samples (the byte order PNG stores them in)
+void repack_bgra16(struct PngImage *img) {
+  size_t pixel_count = (size_t)img->width * img->height;
+  unsigned char *px = img->samples;
+  for (size_t i = 0; i < pixel_count; i++) {
+    const unsigned char *in = &px[8 * i];
+    uint16_t b = in[0] | in[1] << 8, g = in[2] | in[3] << 8,
+             r = in[4] | in[5] << 8, a = in[6] | in[7] << 8;
+    uint16_t rgba[4] = {r, g, b, a};
+    if (img->channels == 2) {
+      rgba[1] = a;
+    }
+    // every sample is read before any get written, and output never runs
+    // past the start of the next pixel's input
+    unsigned char *out = &px[2 * img->channels * i];
+    for (int c = 0; c < img->channels; c++) {
+      out[2 * c + 0] = rgba[c] >> 8;
+      out[2 * c + 1] = rgba[c] & 0xFF;
+    }
+  }
+  unsigned char *shrunk = realloc(px, pixel_count * 2 * img->channels);
+  if (shrunk != NULL) {
+    img->samples = shrunk;
+  }
+}
+
+struct PngImage *image_read_mem(const unsigned char *data, size_t len) {
   struct PngImage *img = malloc(sizeof(struct PngImage));
-  img->pixels_rgba =
-      stbi_load(file_path, &img->width, &img->height, NULL, STBI_rgb_alpha);
-  if (img->pixels_rgba == NULL) {
+  img->channels = png_channels(data, len);
+  img->bit_depth = png_bit_depth(data, len);
+  if (img->bit_depth == 16) {
+    const char *err = png_decode_bgra16(data, len, img);
+    if (err == NULL) {
+      repack_bgra16(img);
+      return img;
+    }
+    fprintf(stderr, "WARNING (Wuffs): %s, decoding as 8-bit instead.\n", err);
+    img->bit_depth = 8;
+  }
+  // the Wuffs STBI drop-in can only produce 1, 3 or 4 channels, so gray +
+  // alpha is decoded as RGBA and squeezed back down below
+  int decode_channels = img->channels == 2 ? 4 : img->channels;
+  if (len <= INT_MAX) {
+    img->samples = stbi_load_from_memory(data, (int)len, &img->width,
+                                         &img->height, NULL, decode_channels);
+  } else {
+    struct MemReader reader = {data, len, 0};
+    stbi_io_callbacks callbacks = {mem_read, mem_skip, mem_eof};
+    img->samples =
+        stbi_load_from_callbacks(&callbacks, &reader, &img->width,
+                                 &img->height, NULL, decode_channels);
+  }
+  if (img->samples == NULL) {
     fprintf(stderr, "ERROR (STBI): %s\n", stbi_failure_reason());
     exit(EXIT_FAILURE);
   }
+  if (img->channels == 2) {
+    size_t pixel_count = (size_t)img->width * img->height;
+    for (size_t i = 0; i < pixel_count; i++) {
+      img->samples[2 * i + 0] = img->samples[4 * i + 0];
+      img->samples[2 * i + 1] = img->samples[4 * i + 3];
+    }
+    // hand back the other half, STBI's buffers are plain malloc'd memory
+    unsigned char *shrunk = realloc(img->samples, pixel_count * 2);
+    if (shrunk != NULL) {
+      img->samples = shrunk;
+    }
+  }
+  return img;
+}
+
+// slurps a file that can't be mapped (e.g. a pipe) into memory
+unsigned char *read_fd(int fd, const char *file_path, size_t *len) {
+  size_t cap = 1 << 16;
+  unsigned char *buf = malloc(cap);
+  *len = 0;
+  while (true) {
+    if (*len == cap) {
+      cap *= 2;
+      buf = realloc(buf, cap);
+    }
+    ssize_t got = read(fd, buf + *len, cap - *len);
+    if (got == 0) {
+      return buf;
+    }
+    if (got < 0 && errno != EINTR) {
+      fprintf(stderr, "ERROR: Could not read %s: %s\n", file_path,
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (got > 0) {
+      *len += got;
+    }
+  }
+}
+
+// decodes straight out of a read-only mapping of the file, so the compressed
+// PNG never gets copied through stdio buffers
+struct PngImage *image_read(const char *file_path) {
+  int fd = open(file_path, O_RDONLY);
+  struct stat st;
+  if (fd < 0 || fstat(fd, &st) != 0) {
+    fprintf(stderr, "ERROR: Could not open %s: %s\n", file_path,
+            strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+
+  // pipes and the like can't be mapped, those get read into memory instead
+  if (!S_ISREG(st.st_mode) || st.st_size == 0) {
+    size_t len;
+    unsigned char *data = read_fd(fd, file_path, &len);
+    close(fd);
+    struct PngImage *img = image_read_mem(data, len);
+    free(data);
+    return img;
+  }
+
+  size_t len = st.st_size;
+  void *data = mmap(NULL, len, PROT_READ, MAP_PRIVATE, fd, 0);
+  if (data == MAP_FAILED) {
+    fprintf(stderr, "ERROR: Could not map %s: %s\n", file_path,
+            strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  // the mapping keeps the file referenced, we don't need the descriptor
+  close(fd);
+  posix_madvise(data, len, POSIX_MADV_SEQUENTIAL);
+
+  struct PngImage *img = image_read_mem(data, len);
+  munmap(data, len);
   return img;
 }
 
@@ -43,33 +326,148 @@ int image_get_width(struct PngImage *img) { return img->width; }
 
 int image_get_height(struct PngImage *img) { return img->height; }
 
-struct Pixel image_get_pixel(struct PngImage *img, int x, int y) {
-  struct Pixel pix;
-  int start = (y * image_get_width(img) * 4) + x * 4;
-  pix.red = img->pixels_rgba[start++];
-  pix.blue = img->pixels_rgba[start++];
-  pix.green = img->pixels_rgba[start++];
-  pix.alpha = img->pixels_rgba[start++];
-  return pix;
+int image_get_channels(struct PngImage *img) { return img->channels; }
+
+int image_get_bit_depth(struct PngImage *img) { return img->bit_depth; }
+
+unsigned char *image_get_samples(struct PngImage *img) { return img->samples; }
+
+// writes a chunk's length, type, data and CRC at p, returning where it ends
+unsigned char *png_put_chunk(unsigned char *p, const char *type,
+                             const unsigned char *data, uint32_t len) {
+  p[0] = len >> 24;
+  p[1] = len >> 16;
+  p[2] = len >> 8;
+  p[3] = len;
+  memcpy(p + 4, type, 4);
+  if (len > 0) {
+    memcpy(p + 8, data, len);
+  }
+  // PNG's CRC is the reflected one, not what crc.c computes for messages
+  wuffs_crc32__ieee_hasher hasher;
+  wuffs_crc32__ieee_hasher__initialize(&hasher, sizeof(hasher), WUFFS_VERSION,
+                                       WUFFS_INITIALIZE__DEFAULT_OPTIONS);
+  uint32_t crc = wuffs_crc32__ieee_hasher__update_u32(
+      &hasher, wuffs_base__make_slice_u8(p + 4, 4 + (size_t)len));
+  p[8 + len + 0] = crc >> 24;
+  p[8 + len + 1] = crc >> 16;
+  p[8 + len + 2] = crc >> 8;
+  p[8 + len + 3] = crc;
+  return p + 12 + len;
 }
 
-void image_set_pixel(struct PngImage *img, int x, int y, struct Pixel pix) {
-  int start = (y * image_get_width(img) * 4) + x * 4;
-  img->pixels_rgba[start++] = pix.red;
-  img->pixels_rgba[start++] = pix.blue;
-  img->pixels_rgba[start++] = pix.green;
-  img->pixels_rgba[start++] = pix.alpha;
+unsigned char paeth(unsigned char a, unsigned char b, unsigned char c) {
+  int p = a + b - c, pa = abs(p - a), pb = abs(p - b), pc = abs(p - c);
+  if (pa <= pb && pa <= pc) {
+    return a;
+  }
+  return pb <= pc ? b : c;
 }
 
-void image_write(struct PngImage *img, const char *file_path) {
-  if (!stbi_write_png(file_path, img->width, img->height, STBI_rgb_alpha,
-                      img->pixels_rgba, STBI_rgb_alpha * img->width)) {
+// STBI only writes 8-bit PNGs, so 16-bit ones are put together here, with every
+// row Paeth filtered and STBI's zlib compressor doing the rest
+unsigned char *png_write_16(struct PngImage *img, size_t *len) {
+  size_t bpp = 2 * img->channels, stride = bpp * img->width;
+  size_t filtered_len = (stride + 1) * img->height;
+  if (filtered_len > INT_MAX) {
+    fprintf(stderr, "ERROR: Image is too large to write.\n");
+    exit(EXIT_FAILURE);
+  }
+  unsigned char *filtered = malloc(filtered_len);
+  for (int y = 0; y < img->height; y++) {
+    const unsigned char *row = img->samples + y * stride;
+    const unsigned char *prev = y > 0 ? row - stride : NULL;
+    unsigned char *out = filtered + y * (stride + 1);
+    out[0] = 4; // Paeth
+    for (size_t x = 0; x < stride; x++) {
+      unsigned char a = x >= bpp ? row[x - bpp] : 0;
+      unsigned char b = prev != NULL ? prev[x] : 0;
+      unsigned char c = prev != NULL && x >= bpp ? prev[x - bpp] : 0;
+      out[1 + x] = row[x] - paeth(a, b, c);
+    }
+  }
+  int zlib_len;
+  unsigned char *zlib =
+      stbi_zlib_compress(filtered, (int)filtered_len, &zlib_len,
+                         stbi_write_png_compression_level);
+  free(filtered);
+  if (zlib == NULL) {
+    fprintf(stderr, "ERROR: STBI zlib compress\n");
+    exit(EXIT_FAILURE);
+  }
+
+  // gray, gray + alpha, RGB and RGBA color types, by channel count
+  const unsigned char color_types[5] = {0, 0, 4, 2, 6};
+  unsigned char ihdr[13] = {0};
+  for (int i = 0; i < 4; i++) {
+    ihdr[0 + i] = (unsigned)img->width >> (24 - 8 * i);
+    ihdr[4 + i] = (unsigned)img->height >> (24 - 8 * i);
+  }
+  ihdr[8] = 16;
+  ihdr[9] = color_types[img->channels];
+
+  const unsigned char signature[8] = {0x89, 'P',  'N',  'G',
+                                      '\r', '\n', 0x1A, '\n'};
+  *len = sizeof(signature) + 12 + sizeof(ihdr) + 12 + zlib_len + 12;
+  // STBIW_MALLOC, so the caller frees this the same way as STBI's own output
+  unsigned char *png = STBIW_MALLOC(*len);
+  memcpy(png, signature, sizeof(signature));
+  unsigned char *p = png_put_chunk(png + sizeof(signature), "IHDR", ihdr,
+                                   sizeof(ihdr));
+  p = png_put_chunk(p, "IDAT", zlib, zlib_len);
+  png_put_chunk(p, "IEND", NULL, 0);
+  STBIW_FREE(zlib);
+  return png;
+}
+
+unsigned char *image_write_mem(struct PngImage *img, size_t *len) {
+  if (img->bit_depth == 16) {
+    return png_write_16(img, len);
+  }
+  int png_len;
+  unsigned char *png =
+      stbi_write_png_to_mem(img->samples, img->channels * img->width,
+                            img->width, img->height, img->channels, &png_len);
+  if (png == NULL) {
     fprintf(stderr, "ERROR: STBI write\n");
     exit(EXIT_FAILURE);
   }
+  *len = png_len;
+  return png;
+}
+
+// STBI assembles the whole PNG in memory anyway, so write that buffer out with
+// write(2) directly rather than going through stdio
+void image_write(struct PngImage *img, const char *file_path) {
+  size_t len;
+  unsigned char *png = image_write_mem(img, &len);
+
+  int fd = open(file_path, O_WRONLY | O_CREAT | O_TRUNC, 0666);
+  if (fd < 0) {
+    fprintf(stderr, "ERROR: Could not open %s: %s\n", file_path,
+            strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  for (size_t done = 0; done < len;) {
+    ssize_t written = write(fd, png + done, len - done);
+    if (written < 0 && errno != EINTR) {
+      fprintf(stderr, "ERROR: Could not write %s: %s\n", file_path,
+              strerror(errno));
+      exit(EXIT_FAILURE);
+    }
+    if (written > 0) {
+      done += written;
+    }
+  }
+  if (close(fd) != 0) {
+    fprintf(stderr, "ERROR: Could not write %s: %s\n", file_path,
+            strerror(errno));
+    exit(EXIT_FAILURE);
+  }
+  STBIW_FREE(png);
 }
 
 void image_free(struct PngImage *img) {
-  stbi_image_free(img->pixels_rgba);
+  stbi_image_free(img->samples);
   free(img);
 }